@@ -34,7 +34,17 @@ void ARB_init(size_t bufferWords, int32_t silenceSample, PinMode direction) {
     ARB_callback = NULL;
     ARB_userBuffer = -1;
     ARB_userOff = 0;
+    ARB_bufferCount = NARB;
     for (size_t i = 0; i < NARB; i++) {
+        // Buffer headers persist across begin/end, the sample storage is resized each time
+        if (!ARB1_buffers[i]) {
+            ARB1_buffers[i] = calloc(1, sizeof(AudioBuffer));
+        }
+        if (!ARB2_buffers[i]) {
+            ARB2_buffers[i] = calloc(1, sizeof(AudioBuffer));
+        }
+        free(ARB1_buffers[i]->buff);
+        free(ARB2_buffers[i]->buff);
         ARB1_buffers[i]->buff = malloc(ARB_wordsPerBuffer * sizeof(uint32_t));
         ARB2_buffers[i]->buff = malloc(ARB_wordsPerBuffer * sizeof(uint32_t));
         ARB1_buffers[i]->empty = true;
@@ -247,8 +257,8 @@ void __not_in_flash_func(ARB_dmaIRQ)(int channel) {
         ARB1_nextBuffer = (ARB1_nextBuffer + 1) % ARB_bufferCount;
     }
     else {
-        ARB2_curBuffer = (ARB1_curBuffer + 1) % ARB_bufferCount;
-        ARB2_nextBuffer = (ARB1_nextBuffer + 1) % ARB_bufferCount;
+        ARB2_curBuffer = (ARB2_curBuffer + 1) % ARB_bufferCount;
+        ARB2_nextBuffer = (ARB2_nextBuffer + 1) % ARB_bufferCount;
     }
 
     dma_channel_acknowledge_irq0(channel);
@@ -19,11 +19,37 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <math.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/clocks.h"
 #include "pio_i2s.pio.h"
 #include "i2s.h"
 
+#if defined(XOSC_KHZ)
+#define I2S_XOSC_KHZ XOSC_KHZ
+#elif defined(XOSC_MHZ)
+#define I2S_XOSC_KHZ (XOSC_MHZ * 1000)
+#else
+#define I2S_XOSC_KHZ 12000
+#endif
+
+#if defined(PICO_PLL_VCO_MIN_FREQ_KHZ)
+#define I2S_VCO_MIN_KHZ PICO_PLL_VCO_MIN_FREQ_KHZ
+#elif defined(PICO_PLL_VCO_MIN_FREQ_MHZ)
+#define I2S_VCO_MIN_KHZ (PICO_PLL_VCO_MIN_FREQ_MHZ * 1000)
+#else
+#define I2S_VCO_MIN_KHZ 750000
+#endif
+
+#if defined(PICO_PLL_VCO_MAX_FREQ_KHZ)
+#define I2S_VCO_MAX_KHZ PICO_PLL_VCO_MAX_FREQ_KHZ
+#elif defined(PICO_PLL_VCO_MAX_FREQ_MHZ)
+#define I2S_VCO_MAX_KHZ (PICO_PLL_VCO_MAX_FREQ_MHZ * 1000)
+#else
+#define I2S_VCO_MAX_KHZ 1600000
+#endif
+
 
 void I2S_init(PinMode direction) {
     I2S_running = false;
@@ -32,6 +58,7 @@ void I2S_init(PinMode direction) {
     I2S_holdWord = 0;
     I2S_wasHolding = 0;
     I2S_isOutput = direction == OUTPUT;
+    I2S_highRate = false;
     I2S_pinBCLK = 26;
     I2S_pinDOUT = 28;
 #ifdef PIN_I2S_BCLK
@@ -89,12 +116,178 @@ bool I2S_setBuffers(size_t bufferWords, int32_t silenceSample) {
     return true;
 }
 
+// Each bit is two PIO instructions (one per BCLK edge), two channels per frame
+static double I2S_pioHz(int freq, int bps) {
+    return (double)freq * bps * 2.0 /* channels */ * 2.0 /* edges per clock */;
+}
+
+// 8 and 16 bit frames pack both channels into one FIFO word, 24 and 32 bit need one per channel
+static uint32_t I2S_wordsPerSecond(int freq, int bps) {
+    return (uint32_t)freq * ((bps <= 16) ? 1 : 2);
+}
+
+// High-rate mode grows the DMA buffers to at least this, bounding the refill IRQ rate;
+// 24 and 32 bit need whole L/R word pairs
+static size_t I2S_highRateBufferWords(int freq, int bps) {
+    size_t minWords = ((uint64_t)I2S_wordsPerSecond(freq, bps) * I2S_HIGHRATE_MIN_BUFFER_US + 999999) / 1000000;
+    if (bps > 16) {
+        minWords = (minWords + 1) & ~(size_t)1;
+    }
+    return minWords;
+}
+
+// Fill in the PIO divider and the rate it produces for one clk_sys candidate
+static bool I2S_planDivider(uint32_t sysHz, int freq, int bps, I2SClockPlan *plan) {
+    double fixed = round((double)sysHz * 256.0 / I2S_pioHz(freq, bps));
+    if ((fixed < 256.0) || (fixed > 65535.0 * 256.0 + 255.0)) {
+        return false;
+    }
+    uint32_t div = (uint32_t)fixed;
+    double achieved = (double)sysHz * 256.0 / div / (I2S_pioHz(freq, bps) / freq);
+    plan->sysClockHz = sysHz;
+    plan->divInt = div >> 8;
+    plan->divFrac = div & 0xff;
+    plan->achievedFreq = achieved;
+    plan->ppmError = (achieved - freq) * 1e6 / freq;
+    // A fractional divider stretches some SM cycles by one clk_sys period
+    plan->jitterNs = plan->divFrac ? 1e9f / sysHz : 0.0f;
+    return true;
+}
+
+// Least error wins; errors within I2S_PLAN_PPM_EPSILON go to the current clk_sys,
+// then to an integer divider, then to the faster clk_sys (less jitter)
+static bool I2S_planIsBetter(const I2SClockPlan *a, const I2SClockPlan *b) {
+    float aErr = fabsf(a->ppmError);
+    float bErr = fabsf(b->ppmError);
+    if (fabsf(aErr - bErr) >= I2S_PLAN_PPM_EPSILON) {
+        return aErr < bErr;
+    }
+    if (a->sysClockChange != b->sysClockChange) {
+        return !a->sysClockChange;
+    }
+    if ((a->divFrac == 0) != (b->divFrac == 0)) {
+        return a->divFrac == 0;
+    }
+    if (a->jitterNs != b->jitterNs) {
+        return a->jitterNs < b->jitterNs;
+    }
+    return aErr < bErr;
+}
+
+bool I2S_planClock(int freq, int bps, size_t bufferWords, bool allowSysClockChange, I2SClockPlan *plan) {
+    if ((freq <= 0) || (bps <= 0) || !plan) {
+        return false;
+    }
+    I2SClockPlan best, cand;
+    bool found = false;
+    uint32_t curSysHz = clock_get_hz(clk_sys);
+
+    memset(&cand, 0, sizeof(cand));
+    if (I2S_planDivider(curSysHz, freq, bps, &cand)) {
+        best = cand;
+        found = true;
+    }
+
+    if (allowSysClockChange) {
+        // Same PLL_SYS search space as check_sys_clock_khz(), REFDIV fixed at 1
+        for (uint fbdiv = 16; fbdiv <= 320; fbdiv++) {
+            uint32_t vcoKHz = I2S_XOSC_KHZ * fbdiv;
+            if ((vcoKHz < I2S_VCO_MIN_KHZ) || (vcoKHz > I2S_VCO_MAX_KHZ)) {
+                continue;
+            }
+            for (uint pd1 = 7; pd1 >= 1; pd1--) {
+                for (uint pd2 = pd1; pd2 >= 1; pd2--) {
+                    uint32_t sysHz = vcoKHz * 1000 / (pd1 * pd2);
+                    if ((sysHz < I2S_MIN_SYS_CLOCK_KHZ * 1000) || (sysHz > I2S_MAX_SYS_CLOCK_KHZ * 1000) || (sysHz == curSysHz)) {
+                        continue;
+                    }
+                    memset(&cand, 0, sizeof(cand));
+                    if (!I2S_planDivider(sysHz, freq, bps, &cand)) {
+                        continue;
+                    }
+                    cand.sysClockChange = true;
+                    cand.vcoHz = vcoKHz * 1000;
+                    cand.postDiv1 = pd1;
+                    cand.postDiv2 = pd2;
+                    if (!found || I2S_planIsBetter(&cand, &best)) {
+                        best = cand;
+                        found = true;
+                    }
+                }
+            }
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    best.pioHeadroom = 100.0 - I2S_pioHz(freq, bps) * 100.0 / best.sysClockHz;
+    best.dmaWordsPerSec = I2S_wordsPerSecond(freq, bps);
+    // Each DMA word is two bus accesses (SRAM and PIO FIFO), against one access per clk_sys cycle
+    best.busHeadroom = 100.0 - 2.0 * best.dmaWordsPerSec * 100.0 / best.sysClockHz;
+    best.bufferPeriodUs = bufferWords * 1e6 / best.dmaWordsPerSec;
+    // The IRQ re-arming one ping-pong channel has to finish before the other drains its buffer
+    double irqUs = (I2S_IRQ_OVERHEAD_CYCLES + (double)bufferWords * I2S_IRQ_CYCLES_PER_WORD) * 1e6 / best.sysClockHz;
+    best.estIrqHeadroom = 100.0 - (irqUs + I2S_CALLBACK_BUDGET_US) * 100.0 / best.bufferPeriodUs;
+    *plan = best;
+    return true;
+}
+
+// Plan exactly what I2S_begin() would apply for this rate, including the high-rate buffer growth
+static bool I2S_planForBegin(int freq, size_t *bufferWords, I2SClockPlan *plan) {
+    *bufferWords = I2S_bufferWords;
+    if (I2S_highRate && (*bufferWords < I2S_highRateBufferWords(freq, I2S_bps))) {
+        *bufferWords = I2S_highRateBufferWords(freq, I2S_bps);
+    }
+    return I2S_planClock(freq, I2S_bps, *bufferWords, I2S_highRate, plan);
+}
+
+bool I2S_getClockPlan(I2SClockPlan *plan) {
+    if (!plan) {
+        return false;
+    }
+    if (!I2S_running) {
+        // Re-plan so changes to bits, buffers or high-rate mode since the last call are reflected
+        size_t bufferWords;
+        return I2S_planForBegin(I2S_freq, &bufferWords, plan);
+    }
+    *plan = I2S_clockPlan;
+    return true;
+}
+
 bool I2S_setFrequency(int newFreq) {
+    I2SClockPlan plan;
+    size_t bufferWords;
+    if (!I2S_running) {
+        // Nothing to apply yet, I2S_begin() plans again with the settings in effect then
+        if (!I2S_planForBegin(newFreq, &bufferWords, &plan)) {
+            return false;
+        }
+        I2S_freq = newFreq;
+        return true;
+    }
+    // The DMA buffers can't grow while running, so high-rate mode can only move to rates they cover
+    if (I2S_highRate && (I2S_highRateBufferWords(newFreq, I2S_bps) > I2S_bufferWords)) {
+        return false;
+    }
+    // clk_sys may only move in I2S_begin(), before the PIO and DMA are running
+    if (!I2S_planClock(newFreq, I2S_bps, I2S_bufferWords, false, &plan)) {
+        return false;
+    }
+    if (I2S_highRate && (plan.estIrqHeadroom < I2S_HIGHRATE_MIN_IRQ_HEADROOM)) {
+        return false;
+    }
     I2S_freq = newFreq;
+    I2S_clockPlan = plan;
+    pio_sm_set_clkdiv_int_frac(I2S_pio, I2S_sm, plan.divInt, plan.divFrac);
+    return true;
+}
+
+bool I2S_setHighRate(bool enable) {
     if (I2S_running) {
-        float bitClk = I2S_freq * I2S_bps * 2.0 /* channels */ * 2.0 /* edges per clock */;
-        pio_sm_set_clkdiv(I2S_pio, I2S_sm, (float)clock_get_hz(clk_sys) / bitClk);
+        return false;
     }
+    I2S_highRate = enable;
     return true;
 }
 
@@ -117,6 +310,19 @@ void I2S_onReceive(void(*fn)(void)) {
 }
 
 bool I2S_begin() {
+    size_t bufferWords;
+    I2SClockPlan plan;
+    if (!I2S_planForBegin(I2S_freq, &bufferWords, &plan)) {
+        return false;
+    }
+    if (I2S_highRate && (plan.estIrqHeadroom < I2S_HIGHRATE_MIN_IRQ_HEADROOM)) {
+        return false;
+    }
+    I2S_bufferWords = bufferWords;
+    I2S_clockPlan = plan;
+    if (plan.sysClockChange) {
+        set_sys_clock_pll(plan.vcoHz, plan.postDiv1, plan.postDiv2);
+    }
     I2S_running = true;
     int off = 0;
     if (I2S_isOutput) {
@@ -124,7 +330,7 @@ bool I2S_begin() {
     } else {
         pio_i2s_in_program_init(I2S_pio, I2S_sm, off, I2S_pinDOUT, I2S_pinBCLK, I2S_bps);
     }
-    I2S_setFrequency(I2S_freq);
+    pio_sm_set_clkdiv_int_frac(I2S_pio, I2S_sm, I2S_clockPlan.divInt, I2S_clockPlan.divFrac);
     if (I2S_bps == 8) {
         uint8_t a = I2S_silenceSample & 0xff;
         I2S_silenceSample = (a << 24) | (a << 16) | (a << 8) | a;
@@ -24,13 +24,86 @@
 #include "hardware/pio.h"
 #include "audioringbuffer.h"
 
+// Limits for the clock planner when it is allowed to reprogram clk_sys
+#ifndef I2S_MIN_SYS_CLOCK_KHZ
+#define I2S_MIN_SYS_CLOCK_KHZ 100000
+#endif
+#ifndef I2S_MAX_SYS_CLOCK_KHZ
+#define I2S_MAX_SYS_CLOCK_KHZ 133000
+#endif
+
+// Plans whose errors differ by less than this are ranked as equally accurate,
+// and the tie goes to leaving clk_sys alone, then to an integer divider,
+// then to the faster clk_sys. clk_sys only moves for a real accuracy gain.
+#ifndef I2S_PLAN_PPM_EPSILON
+#define I2S_PLAN_PPM_EPSILON 0.5f
+#endif
+
+// Cost model for the DMA refill IRQ, used for estIrqHeadroom. The fixed part covers
+// entry, the shared handler dispatch and reprogramming the channel, the per-word
+// part the silence refill on output. The callback budget is the worst case the
+// user's onTransmit/onReceive callback is allowed to take. These are estimates,
+// not measurements; tune them for your build and callback.
+#ifndef I2S_IRQ_OVERHEAD_CYCLES
+#define I2S_IRQ_OVERHEAD_CYCLES 200
+#endif
+#ifndef I2S_IRQ_CYCLES_PER_WORD
+#define I2S_IRQ_CYCLES_PER_WORD 6
+#endif
+#ifndef I2S_CALLBACK_BUDGET_US
+#define I2S_CALLBACK_BUDGET_US 50
+#endif
+
+// High-rate mode grows the DMA buffers so each lasts at least this long, and
+// refuses to start unless the estimated refill IRQ keeps this much of its deadline spare
+#ifndef I2S_HIGHRATE_MIN_BUFFER_US
+#define I2S_HIGHRATE_MIN_BUFFER_US 250
+#endif
+#ifndef I2S_HIGHRATE_MIN_IRQ_HEADROOM
+#define I2S_HIGHRATE_MIN_IRQ_HEADROOM 50.0f
+#endif
+
+typedef struct {
+    uint32_t sysClockHz;     // clk_sys this plan runs at
+    bool sysClockChange;     // Plan moves clk_sys to vcoHz/postDiv1/postDiv2, applied by I2S_begin()
+    uint32_t vcoHz;
+    uint postDiv1;
+    uint postDiv2;
+    uint16_t divInt;         // PIO SM clock divider, 16.8 fixed point
+    uint8_t divFrac;
+    float achievedFreq;      // Sample rate that actually comes out of the pins
+    float ppmError;          // (achieved - requested) / requested
+    float jitterNs;          // Peak BCLK edge jitter, 0 for integer dividers
+    float pioHeadroom;       // % of clk_sys left above the SM clock (divider can't go below 1.0)
+    uint32_t dmaWordsPerSec; // 32-bit FIFO words moved per second
+    float busHeadroom;       // % of clk_sys cycles left after the DMA's two bus accesses per word
+    float bufferPeriodUs;    // Time to drain one DMA buffer, i.e. the refill IRQ deadline
+    float estIrqHeadroom;    // % of bufferPeriodUs left after the modelled refill IRQ and callback
+} I2SClockPlan;
+
 void I2S_init(PinMode direction);
 
 bool I2S_setBCLK(uint pin);
 bool I2S_setDATA(uint pin);
 bool I2S_setBitsPerSample(int bps);
 bool I2S_setBuffers(size_t bufferWords, int32_t silenceSample);
+// In high-rate mode a running port only accepts rates its DMA buffers and
+// refill IRQ budget cover; otherwise it returns false and keeps the old rate
 bool I2S_setFrequency(int newFreq);
+// Let I2S_begin() reprogram clk_sys when that gets closer to the requested rate,
+// and size the DMA buffers for the refill IRQ deadline. Moving clk_sys also
+// retimes clk_peri, so stdio UART and other UART/SPI users must be re-initialized
+// after I2S_begin(); check I2S_getClockPlan() to see if it happened.
+// The mode is only gated on the estimated IRQ cost above, not a measured run, so
+// watch ARB_getOverUnderflow() to confirm a given rate and callback keep up.
+bool I2S_setHighRate(bool enable);
+
+// Search PIO dividers (and, if allowed, PLL_SYS settings) for the smallest rate
+// error, preferring the current clk_sys, then integer dividers. Returns false if no divider can reach it.
+bool I2S_planClock(int freq, int bps, size_t bufferWords, bool allowSysClockChange, I2SClockPlan *plan);
+// Copy of the plan in effect while running; when stopped, planned afresh from
+// the current settings exactly as I2S_begin() would apply it
+bool I2S_getClockPlan(I2SClockPlan *plan);
 
 bool I2S_begin();
 void I2S_end();
@@ -68,6 +141,8 @@ int I2S_freq;
 size_t I2S_bufferWords;
 int32_t I2S_silenceSample;
 bool I2S_isOutput;
+bool I2S_highRate;
+I2SClockPlan I2S_clockPlan;
 
 bool I2S_running;
 